@@ -0,0 +1,269 @@
+// Uploads the atlas of a loaded .bfa file into a sampled VkImage.
+//
+// Include after <vulkan/vulkan.h>. Everything is static so the header can be
+// dropped into a single translation unit the same way as cli.c and example.c.
+//
+// The image is created as VK_FORMAT_R8_UNORM and is left in
+// VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, ready to be sampled from the
+// shader stages the caller passes in. Creating the sampler is left to the caller.
+#ifndef BFA_VULKAN_H
+#define BFA_VULKAN_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define BFA_MAGIC 0x6166622e
+
+struct bfa_vulkan_file_header {
+	uint32_t magic;
+	uint32_t flags;
+	uint16_t glyph_count;
+	uint8_t map_type;
+	uint8_t font_size;
+	uint16_t atlas_width;
+	uint16_t atlas_height;
+	uint16_t largest_glyph_width;
+	uint16_t largest_glyph_height;
+	uint32_t size_of_stored_image_data;
+};
+
+struct bfa_vulkan_atlas {
+	VkImage image;
+	VkImageView image_view;
+	VkDeviceMemory memory;
+	uint32_t width;
+	uint32_t height;
+};
+
+// Returns the offset of the image data in the file, or 0 if the map type is unknown.
+static size_t bfa_vulkan_image_data_offset(const struct bfa_vulkan_file_header *header) {
+	size_t glyph_size = 16;
+	
+	switch (header->map_type) {
+		case 0: return sizeof(*header) + 16384 * glyph_size;
+		case 1: return sizeof(*header) + 256 * glyph_size;
+		case 2: return sizeof(*header) + header->glyph_count * (sizeof(uint16_t) + glyph_size);
+		case 3: return sizeof(*header) + header->glyph_count * (sizeof(uint32_t) + glyph_size);
+	}
+	
+	return 0;
+}
+
+static uint32_t bfa_vulkan_find_memory_type(VkPhysicalDevice physical_device, uint32_t type_bits,
+											VkMemoryPropertyFlags desired_flags) {
+	VkPhysicalDeviceMemoryProperties memory_properties;
+	vkGetPhysicalDeviceMemoryProperties(physical_device, &memory_properties);
+	
+	for (uint32_t i = 0; i < memory_properties.memoryTypeCount; ++i) {
+		if ((type_bits & (1u << i)) &&
+			(memory_properties.memoryTypes[i].propertyFlags & desired_flags) == desired_flags) {
+			return i;
+		}
+	}
+	
+	return UINT32_MAX;
+}
+
+static void bfa_vulkan_destroy_atlas(VkDevice device, struct bfa_vulkan_atlas *atlas) {
+	if (atlas->image_view) vkDestroyImageView(device, atlas->image_view, NULL);
+	if (atlas->image) vkDestroyImage(device, atlas->image, NULL);
+	if (atlas->memory) vkFreeMemory(device, atlas->memory, NULL);
+	memset(atlas, 0, sizeof(*atlas));
+}
+
+// Copies the atlas of file_data into a new image using one command buffer
+// submission on queue, which must belong to the family command_pool was
+// created for. Blocks until the copy is finished.
+//
+// shader_stages are the stages that sample the atlas, for example
+// VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT. The queue family must support them,
+// so it has to be a graphics queue for the fragment stage or a compute queue
+// for the compute stage. Transfer-only queues can't be used.
+static VkResult bfa_vulkan_upload_atlas(VkPhysicalDevice physical_device, VkDevice device,
+										VkQueue queue, VkCommandPool command_pool,
+										VkPipelineStageFlags shader_stages,
+										const void *file_data, size_t file_size,
+										struct bfa_vulkan_atlas *atlas) {
+	const struct bfa_vulkan_file_header *header = file_data;
+	VkBuffer staging_buffer = VK_NULL_HANDLE;
+	VkDeviceMemory staging_buffer_memory = VK_NULL_HANDLE;
+	VkCommandBuffer command_buffer = VK_NULL_HANDLE;
+	VkFence fence = VK_NULL_HANDLE;
+	VkMemoryRequirements memory_requirements;
+	VkResult result = VK_SUCCESS;
+	size_t image_data_offset;
+	void *staging_buffer_pointer;
+	
+	memset(atlas, 0, sizeof(*atlas));
+	
+	if (file_size < sizeof(*header) || header->magic != BFA_MAGIC) return VK_ERROR_INITIALIZATION_FAILED;
+	
+	image_data_offset = bfa_vulkan_image_data_offset(header);
+	if (!image_data_offset || image_data_offset > file_size ||
+		file_size - image_data_offset < header->size_of_stored_image_data) {
+		return VK_ERROR_INITIALIZATION_FAILED;
+	}
+	
+	atlas->width = header->atlas_width;
+	atlas->height = header->atlas_height;
+	
+	const VkDeviceSize image_size = (VkDeviceSize)atlas->width * atlas->height;
+	if (!image_size || header->size_of_stored_image_data > image_size) return VK_ERROR_INITIALIZATION_FAILED;
+
+#define BFA_VULKAN_CHECK(call) do { result = (call); if (result != VK_SUCCESS) goto END; } while (0)
+	
+	// Staging buffer holding the whole image. The stored image data can be
+	// shorter than the atlas, the rest of it is zero.
+	{
+		VkBufferCreateInfo buffer = {VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO};
+		buffer.size = image_size;
+		buffer.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+		buffer.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+		BFA_VULKAN_CHECK(vkCreateBuffer(device, &buffer, NULL, &staging_buffer));
+		
+		VkMemoryAllocateInfo memory_allocation = {VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO};
+		vkGetBufferMemoryRequirements(device, staging_buffer, &memory_requirements);
+		memory_allocation.allocationSize = memory_requirements.size;
+		memory_allocation.memoryTypeIndex = bfa_vulkan_find_memory_type(
+			physical_device, memory_requirements.memoryTypeBits,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+		if (memory_allocation.memoryTypeIndex == UINT32_MAX) {
+			result = VK_ERROR_FEATURE_NOT_PRESENT;
+			goto END;
+		}
+		
+		BFA_VULKAN_CHECK(vkAllocateMemory(device, &memory_allocation, NULL, &staging_buffer_memory));
+		BFA_VULKAN_CHECK(vkBindBufferMemory(device, staging_buffer, staging_buffer_memory, 0));
+		BFA_VULKAN_CHECK(vkMapMemory(device, staging_buffer_memory, 0, VK_WHOLE_SIZE, 0, &staging_buffer_pointer));
+		
+		memcpy(staging_buffer_pointer, (const uint8_t*)file_data + image_data_offset,
+			   header->size_of_stored_image_data);
+		memset((uint8_t*)staging_buffer_pointer + header->size_of_stored_image_data, 0,
+			   image_size - header->size_of_stored_image_data);
+	}
+	
+	// Sampled image
+	{
+		VkImageCreateInfo image = {VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO};
+		image.imageType = VK_IMAGE_TYPE_2D;
+		image.format = VK_FORMAT_R8_UNORM;
+		image.extent.width = atlas->width;
+		image.extent.height = atlas->height;
+		image.extent.depth = 1;
+		image.mipLevels = 1;
+		image.arrayLayers = 1;
+		image.samples = VK_SAMPLE_COUNT_1_BIT;
+		image.tiling = VK_IMAGE_TILING_OPTIMAL;
+		image.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT|VK_IMAGE_USAGE_SAMPLED_BIT;
+		BFA_VULKAN_CHECK(vkCreateImage(device, &image, NULL, &atlas->image));
+		
+		VkMemoryAllocateInfo memory_allocation = {VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO};
+		vkGetImageMemoryRequirements(device, atlas->image, &memory_requirements);
+		memory_allocation.allocationSize = memory_requirements.size;
+		memory_allocation.memoryTypeIndex = bfa_vulkan_find_memory_type(
+			physical_device, memory_requirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+		if (memory_allocation.memoryTypeIndex == UINT32_MAX) {
+			memory_allocation.memoryTypeIndex = bfa_vulkan_find_memory_type(
+				physical_device, memory_requirements.memoryTypeBits, 0);
+		}
+		if (memory_allocation.memoryTypeIndex == UINT32_MAX) {
+			result = VK_ERROR_FEATURE_NOT_PRESENT;
+			goto END;
+		}
+		
+		BFA_VULKAN_CHECK(vkAllocateMemory(device, &memory_allocation, NULL, &atlas->memory));
+		BFA_VULKAN_CHECK(vkBindImageMemory(device, atlas->image, atlas->memory, 0));
+		
+		VkImageViewCreateInfo image_view = {VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO};
+		image_view.image = atlas->image;
+		image_view.viewType = VK_IMAGE_VIEW_TYPE_2D;
+		image_view.format = VK_FORMAT_R8_UNORM;
+		image_view.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		image_view.subresourceRange.levelCount = 1;
+		image_view.subresourceRange.layerCount = 1;
+		BFA_VULKAN_CHECK(vkCreateImageView(device, &image_view, NULL, &atlas->image_view));
+	}
+	
+	// Record and submit the copy
+	{
+		VkCommandBufferAllocateInfo command_buffer_info = {VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO};
+		command_buffer_info.commandPool = command_pool;
+		command_buffer_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+		command_buffer_info.commandBufferCount = 1;
+		BFA_VULKAN_CHECK(vkAllocateCommandBuffers(device, &command_buffer_info, &command_buffer));
+		
+		VkFenceCreateInfo fence_info = {VK_STRUCTURE_TYPE_FENCE_CREATE_INFO};
+		BFA_VULKAN_CHECK(vkCreateFence(device, &fence_info, NULL, &fence));
+		
+		VkCommandBufferBeginInfo begin = {VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO};
+		begin.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+		BFA_VULKAN_CHECK(vkBeginCommandBuffer(command_buffer, &begin));
+		
+		VkImageMemoryBarrier image_barrier = {VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER};
+		image_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		image_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		image_barrier.image = atlas->image;
+		image_barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		image_barrier.subresourceRange.levelCount = 1;
+		image_barrier.subresourceRange.layerCount = 1;
+		image_barrier.srcAccessMask = 0;
+		image_barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		image_barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+		image_barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+		
+		vkCmdPipelineBarrier(command_buffer,
+							 VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+							 VK_PIPELINE_STAGE_TRANSFER_BIT,
+							 0,
+							 0, NULL,
+							 0, NULL,
+							 1, &image_barrier
+							 );
+		
+		VkBufferImageCopy buffer_copy = {0};
+		buffer_copy.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		buffer_copy.imageSubresource.layerCount = 1;
+		buffer_copy.imageExtent.width = atlas->width;
+		buffer_copy.imageExtent.height = atlas->height;
+		buffer_copy.imageExtent.depth = 1;
+		
+		vkCmdCopyBufferToImage(command_buffer, staging_buffer, atlas->image,
+							   VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &buffer_copy);
+		
+		image_barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		image_barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+		image_barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+		image_barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		
+		vkCmdPipelineBarrier(command_buffer,
+							 VK_PIPELINE_STAGE_TRANSFER_BIT,
+							 shader_stages,
+							 0,
+							 0, NULL,
+							 0, NULL,
+							 1, &image_barrier
+							 );
+		
+		BFA_VULKAN_CHECK(vkEndCommandBuffer(command_buffer));
+		
+		VkSubmitInfo submit = {VK_STRUCTURE_TYPE_SUBMIT_INFO};
+		submit.commandBufferCount = 1;
+		submit.pCommandBuffers = &command_buffer;
+		
+		BFA_VULKAN_CHECK(vkQueueSubmit(queue, 1, &submit, fence));
+		BFA_VULKAN_CHECK(vkWaitForFences(device, 1, &fence, VK_TRUE, UINT64_MAX));
+	}
+
+#undef BFA_VULKAN_CHECK
+	
+	END:
+	if (fence) vkDestroyFence(device, fence, NULL);
+	if (command_buffer) vkFreeCommandBuffers(device, command_pool, 1, &command_buffer);
+	if (staging_buffer) vkDestroyBuffer(device, staging_buffer, NULL);
+	if (staging_buffer_memory) vkFreeMemory(device, staging_buffer_memory, NULL);
+	if (result != VK_SUCCESS) bfa_vulkan_destroy_atlas(device, atlas);
+	
+	return result;
+}
+
+#endif
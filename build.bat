@@ -2,6 +2,7 @@
 
 cl /O2 .\cli.c /I.\external /I%VULKAN_SDK%\Include .\external\freetype.lib %VULKAN_SDK%\Lib\vulkan-1.lib /Fe:.\bfa.exe
 cl /O2 .\example.c /I.\external /I%VULKAN_SDK%\Include .\external\freetype.lib %VULKAN_SDK%\Lib\vulkan-1.lib /Fe:.\bfa_glyph.exe
+cl /Zs /TC /FIvulkan/vulkan.h .\bfa_vulkan.h /I%VULKAN_SDK%\Include
 
 @echo on
 
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
 #include <vulkan/vulkan.h>
 #include <freetype/freetype.h>
 
@@ -12,6 +13,14 @@ enum {
 	MAX_TEXTURE_DIMENSION = 16384,
 };
 
+enum {
+	// Glyphs are rasterized into one staging slot while the GPU copies
+	// the previous one into the atlas.
+	STAGING_SLOT_COUNT = 2,
+	STAGING_SLOT_SIZE = 4 << 20,
+	MAX_COPY_REGIONS_PER_BATCH = 1024,
+};
+
 enum {
 	PROGRAM_FLAG_DEBUG = 0x1,
 };
@@ -24,8 +33,22 @@ enum {
 	MAP_TYPE_UTF16,
 	MAP_TYPE_ASCII,
 	MAP_TYPE_UTF16_MAPPED,
+	MAP_TYPE_UNICODE_MAPPED,
 	  };
 
+enum {
+	MAX_GLYPH_COUNT = 0xffff,
+	UNICODE_CODEPOINT_COUNT = 0x110000,
+};
+
+#define VK_CHECK(call) do { \
+		VkResult vk_check_result = (call); \
+		if (vk_check_result != VK_SUCCESS) { \
+			printf("Vulkan error %d: %s\n", (int)vk_check_result, #call); \
+			exit(1); \
+		} \
+	} while (0)
+
 struct bfa_glyph {
 	uint16_t x, y;
 	uint16_t w, h;
@@ -49,28 +72,201 @@ struct bfa_header {
 	uint32_t size_of_stored_image_data;
 };
 
+// Parallel arrays of the codepoints the font maps and their glyph indices,
+// in increasing codepoint order.
+struct char_map {
+	uint32_t *char_codes;
+	uint32_t *glyph_indices;
+	int count;
+	int capacity;
+};
+
+// A row of the atlas, free to the right of free_x.
+struct atlas_shelf {
+	int y;
+	int height;
+	int free_x;
+};
+
+struct staging_slot {
+	VkBuffer buffer;
+	VkDeviceMemory memory;
+	uint8_t *pointer;
+	VkDeviceSize size;
+	VkDeviceSize used;
+	VkCommandBuffer command_buffer;
+	VkFence fence;
+	int in_flight;
+	uint32_t region_count;
+	VkBufferImageCopy regions[MAX_COPY_REGIONS_PER_BATCH];
+};
+
 struct vulkan_context {
 	VkInstance instance;
 	VkDevice device;
 	VkPhysicalDevice physical_device;
+	VkPhysicalDeviceMemoryProperties memory_properties;
+	uint32_t queue_family_index;
 	VkQueue queue;
 	VkCommandPool command_pool;
-	VkCommandBuffer command_buffer;
-	uint32_t memory_type_indices[2];
-	VkBuffer staging_buffer;
-	VkDeviceMemory staging_buffer_memory;
-	void *staging_buffer_pointer;
-	VkFence fence;
+	struct staging_slot staging_slots[STAGING_SLOT_COUNT];
+	int current_staging_slot;
+	int batch_count;
+	VkBuffer readback_buffer;
+	VkDeviceMemory readback_buffer_memory;
+	void *readback_buffer_pointer;
 };
 
 static struct vulkan_context vk;
 static int max_image_width = 8192;
 static int max_image_height = 8192;
 static char *tga_file_name;
+static char *frequency_profile_path;
+static int append_mode;
 static int requested_font_size = 16;
-static int map_type = MAP_TYPE_UTF16_MAPPED;
+static int map_type = MAP_TYPE_UNICODE_MAPPED;
+
+static const VkMemoryPropertyFlags memory_type_flags[] = {
+	[MEMORY_TYPE_CPU] = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+	[MEMORY_TYPE_GPU] = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+};
+
+static uint32_t find_memory_type(const VkPhysicalDeviceMemoryProperties *memory_properties,
+								 uint32_t type_bits, VkMemoryPropertyFlags desired_flags) {
+	for (uint32_t i = 0; i < memory_properties->memoryTypeCount; ++i) {
+		if ((type_bits & (1u << i)) &&
+			(memory_properties->memoryTypes[i].propertyFlags & desired_flags) == desired_flags) {
+			return i;
+		}
+	}
+	
+	return UINT32_MAX;
+}
+
+static void allocate_memory(const VkMemoryRequirements *memory_requirements, int memory_type,
+							VkDeviceMemory *memory) {
+	VkMemoryAllocateInfo memory_allocation = {VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO};
+	memory_allocation.allocationSize = memory_requirements->size;
+	memory_allocation.memoryTypeIndex = find_memory_type(&vk.memory_properties,
+														 memory_requirements->memoryTypeBits,
+														 memory_type_flags[memory_type]);
+	
+	// Device local is only a preference, software drivers like lavapipe
+	// are free to expose a single memory heap.
+	if (memory_allocation.memoryTypeIndex == UINT32_MAX && memory_type == MEMORY_TYPE_GPU) {
+		memory_allocation.memoryTypeIndex = find_memory_type(&vk.memory_properties,
+															 memory_requirements->memoryTypeBits, 0);
+	}
+	
+	if (memory_allocation.memoryTypeIndex == UINT32_MAX) {
+		printf("No suitable Vulkan memory type found\n");
+		exit(1);
+	}
+	
+	VK_CHECK(vkAllocateMemory(vk.device, &memory_allocation, NULL, memory));
+}
 
-static void init_vulkan_context(uint32_t staging_buffer_size) {
+// CPU side allocations, exit when out of memory. Zero sizes are allowed and
+// still return a valid pointer.
+static void *xmalloc(size_t size) {
+	void *pointer = malloc(size ? size : 1);
+	if (!pointer) {
+		printf("Out of memory\n");
+		exit(1);
+	}
+	return pointer;
+}
+
+static void *xcalloc(size_t count, size_t size) {
+	void *pointer = calloc(count ? count : 1, size ? size : 1);
+	if (!pointer) {
+		printf("Out of memory\n");
+		exit(1);
+	}
+	return pointer;
+}
+
+static void *xrealloc(void *pointer, size_t size) {
+	pointer = realloc(pointer, size ? size : 1);
+	if (!pointer) {
+		printf("Out of memory\n");
+		exit(1);
+	}
+	return pointer;
+}
+
+static void create_host_buffer(VkDeviceSize size, VkBufferUsageFlags usage,
+							   VkBuffer *buffer, VkDeviceMemory *memory, void **pointer) {
+	VkBufferCreateInfo buffer_info = {VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO};
+	buffer_info.size = size;
+	buffer_info.usage = usage;
+	buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	
+	VK_CHECK(vkCreateBuffer(vk.device, &buffer_info, NULL, buffer));
+	
+	VkMemoryRequirements memory_requirements;
+	vkGetBufferMemoryRequirements(vk.device, *buffer, &memory_requirements);
+	allocate_memory(&memory_requirements, MEMORY_TYPE_CPU, memory);
+	
+	VK_CHECK(vkBindBufferMemory(vk.device, *buffer, *memory, 0));
+	VK_CHECK(vkMapMemory(vk.device, *memory, 0, VK_WHOLE_SIZE, 0, pointer));
+}
+
+// Returns a score for how well the device suits baking the atlas,
+// or -1 if it can't be used at all.
+static int score_physical_device(VkPhysicalDevice physical_device, uint32_t image_width,
+								 uint32_t image_height, uint32_t *queue_family_index) {
+	VkPhysicalDeviceProperties properties;
+	VkPhysicalDeviceMemoryProperties memory_properties;
+	VkImageFormatProperties format_properties;
+	VkQueueFamilyProperties queue_families[32];
+	uint32_t queue_family_count = 32;
+	
+	vkGetPhysicalDeviceProperties(physical_device, &properties);
+	vkGetPhysicalDeviceMemoryProperties(physical_device, &memory_properties);
+	vkGetPhysicalDeviceQueueFamilyProperties(physical_device, &queue_family_count, queue_families);
+	
+	// Glyphs are copied to arbitrary texel offsets, so the queue must not have
+	// a coarser image transfer granularity. Graphics and compute queues never do.
+	*queue_family_index = UINT32_MAX;
+	for (uint32_t i = 0; i < queue_family_count; ++i) {
+		VkExtent3D granularity = queue_families[i].minImageTransferGranularity;
+		VkQueueFlags transfer_capable =
+			VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT | VK_QUEUE_TRANSFER_BIT;
+		
+		if (queue_families[i].queueCount && (queue_families[i].queueFlags & transfer_capable) &&
+			granularity.width == 1 && granularity.height == 1 && granularity.depth == 1) {
+			*queue_family_index = i;
+			break;
+		}
+	}
+	if (*queue_family_index == UINT32_MAX) return -1;
+	
+	if (vkGetPhysicalDeviceImageFormatProperties(physical_device, VK_FORMAT_R8_UINT, VK_IMAGE_TYPE_2D,
+												 VK_IMAGE_TILING_OPTIMAL,
+												 VK_IMAGE_USAGE_TRANSFER_DST_BIT|VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+												 0, &format_properties) != VK_SUCCESS) {
+		return -1;
+	}
+	if (format_properties.maxExtent.width < image_width ||
+		format_properties.maxExtent.height < image_height) {
+		return -1;
+	}
+	
+	if (find_memory_type(&memory_properties, ~0u, memory_type_flags[MEMORY_TYPE_CPU]) == UINT32_MAX) {
+		return -1;
+	}
+	
+	switch (properties.deviceType) {
+		case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU: return 4;
+		case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU: return 3;
+		case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU: return 2;
+		case VK_PHYSICAL_DEVICE_TYPE_CPU: return 1;
+		default: return 0;
+	}
+}
+
+static void init_vulkan_context(uint32_t image_width, uint32_t image_height, VkDeviceSize largest_glyph_size) {
 	// Instance
 	{
 		VkApplicationInfo app = {VK_STRUCTURE_TYPE_APPLICATION_INFO};
@@ -88,7 +284,40 @@ static void init_vulkan_context(uint32_t staging_buffer_size) {
 		instance.ppEnabledLayerNames = (const char *const[]) {"VK_LAYER_KHRONOS_validation"};
 		instance.enabledLayerCount = 1;
 		#endif
-		vkCreateInstance(&instance, NULL, &vk.instance);
+		VK_CHECK(vkCreateInstance(&instance, NULL, &vk.instance));
+	}
+	
+	// Physical device
+	{
+		VkPhysicalDevice physical_devices[16];
+		uint32_t physical_device_count = 16;
+		int best_score = -1;
+		
+		VkResult result = vkEnumeratePhysicalDevices(vk.instance, &physical_device_count, physical_devices);
+		if (result != VK_SUCCESS && result != VK_INCOMPLETE) {
+			VK_CHECK(result);
+		}
+		
+		for (uint32_t i = 0; i < physical_device_count; ++i) {
+			uint32_t queue_family_index;
+			int score = score_physical_device(physical_devices[i], image_width, image_height,
+											  &queue_family_index);
+			if (score > best_score) {
+				best_score = score;
+				vk.physical_device = physical_devices[i];
+				vk.queue_family_index = queue_family_index;
+			}
+		}
+		
+		if (best_score < 0) {
+			printf("No Vulkan device can bake a %ux%u atlas\n", image_width, image_height);
+			exit(1);
+		}
+		
+		VkPhysicalDeviceProperties properties;
+		vkGetPhysicalDeviceProperties(vk.physical_device, &properties);
+		vkGetPhysicalDeviceMemoryProperties(vk.physical_device, &vk.memory_properties);
+		printf("Device: %s\n", properties.deviceName);
 	}
 	
 	// Device
@@ -96,91 +325,428 @@ static void init_vulkan_context(uint32_t staging_buffer_size) {
 		VkDeviceCreateInfo device = {VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO};
 		VkDeviceQueueCreateInfo queue_info = {VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO};
 		const float queue_priorities = {0.f};
-		uint32_t one = 1;
-		
-		vkEnumeratePhysicalDevices(vk.instance, &one, &vk.physical_device);
 		
-		queue_info.queueFamilyIndex = 0;
+		queue_info.queueFamilyIndex = vk.queue_family_index;
 		queue_info.queueCount = 1;
 		queue_info.pQueuePriorities = &queue_priorities;
 		
 		device.queueCreateInfoCount = 1;
 		device.pQueueCreateInfos = &queue_info;
 		
-		vkCreateDevice(vk.physical_device, &device, NULL, &vk.device);
-		vkGetDeviceQueue(vk.device, 0, 0, &vk.queue);
+		VK_CHECK(vkCreateDevice(vk.physical_device, &device, NULL, &vk.device));
+		vkGetDeviceQueue(vk.device, vk.queue_family_index, 0, &vk.queue);
 	}
 	
-	// Memory type map
+	// Command pool
 	{
-		VkPhysicalDeviceMemoryProperties memory_properties;
-		vkGetPhysicalDeviceMemoryProperties(vk.physical_device, &memory_properties);
-		
-		VkMemoryPropertyFlags desired_cpu_memory_flags = 
-			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
-		VkMemoryPropertyFlags desired_gpu_memory_flags = 
-			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
-		
-		for (int i = 0; i < memory_properties.memoryTypeCount; ++i) {
-			if ((memory_properties.memoryTypes[i].propertyFlags & desired_cpu_memory_flags) == 
-				desired_cpu_memory_flags) {
-				vk.memory_type_indices[MEMORY_TYPE_CPU] = i;
-				break;
-			}
-		}
+		VkCommandPoolCreateInfo command_pool = {VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO};
+		command_pool.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+		command_pool.queueFamilyIndex = vk.queue_family_index;
+		VK_CHECK(vkCreateCommandPool(vk.device, &command_pool, NULL, &vk.command_pool));
+	}
+	
+	// Staging slots. Each one needs to hold at least the largest glyph.
+	{
+		VkDeviceSize slot_size = STAGING_SLOT_SIZE;
+		if (slot_size < largest_glyph_size) slot_size = largest_glyph_size;
 		
-		for (int i = 0; i < memory_properties.memoryTypeCount; ++i) {
-			if ((memory_properties.memoryTypes[i].propertyFlags & desired_gpu_memory_flags) == 
-				desired_gpu_memory_flags) {
-				vk.memory_type_indices[MEMORY_TYPE_GPU] = i;
-				break;
-			}
+		for (int i = 0; i < STAGING_SLOT_COUNT; ++i) {
+			struct staging_slot *slot = &vk.staging_slots[i];
+			
+			VkCommandBufferAllocateInfo command_buffer = {VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO};
+			command_buffer.commandPool = vk.command_pool;
+			command_buffer.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+			command_buffer.commandBufferCount = 1;
+			VK_CHECK(vkAllocateCommandBuffers(vk.device, &command_buffer, &slot->command_buffer));
+			
+			VkFenceCreateInfo fence = {VK_STRUCTURE_TYPE_FENCE_CREATE_INFO};
+			VK_CHECK(vkCreateFence(vk.device, &fence, NULL, &slot->fence));
+			
+			slot->size = slot_size;
+			create_host_buffer(slot_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+							   &slot->buffer, &slot->memory, (void**)&slot->pointer);
 		}
 	}
 	
-	// Command buffer
+	// Readback buffer for the finished atlas
 	{
-		VkCommandPoolCreateInfo command_pool = {VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO};
-		command_pool.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
-		vkCreateCommandPool(vk.device, &command_pool, NULL, &vk.command_pool);
+		create_host_buffer((VkDeviceSize)image_width * image_height, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+						   &vk.readback_buffer, &vk.readback_buffer_memory, &vk.readback_buffer_pointer);
+	}
+}
+
+// Waits until the current staging slot is no longer read by the GPU and
+// starts recording a new batch of copies into it.
+static void begin_staging_batch(VkImage image) {
+	struct staging_slot *slot = &vk.staging_slots[vk.current_staging_slot];
+	
+	if (slot->in_flight) {
+		VK_CHECK(vkWaitForFences(vk.device, 1, &slot->fence, VK_TRUE, UINT64_MAX));
+		VK_CHECK(vkResetFences(vk.device, 1, &slot->fence));
+		slot->in_flight = 0;
+	}
+	
+	slot->used = 0;
+	slot->region_count = 0;
+	
+	VkCommandBufferBeginInfo begin = {VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO};
+	begin.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	VK_CHECK(vkBeginCommandBuffer(slot->command_buffer, &begin));
+	
+	if (vk.batch_count++ == 0) {
+		VkImageMemoryBarrier image_barrier = {VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER};
+		image_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		image_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		image_barrier.image = image;
+		image_barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		image_barrier.subresourceRange.levelCount = 1;
+		image_barrier.subresourceRange.layerCount = 1;
+		image_barrier.srcAccessMask = 0;
+		image_barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		image_barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+		image_barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+		
+		vkCmdPipelineBarrier(slot->command_buffer,
+							 VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+							 VK_PIPELINE_STAGE_TRANSFER_BIT,
+							 0,
+							 0, NULL,
+							 0, NULL,
+							 1, &image_barrier
+							 );
+	}
+}
+
+// Records all queued glyph copies of the current slot as one copy command and
+// submits it without waiting. The last batch also copies the atlas back into
+// the readback buffer.
+static void submit_staging_batch(VkImage image, int is_last_batch, uint32_t image_width, uint32_t image_height) {
+	struct staging_slot *slot = &vk.staging_slots[vk.current_staging_slot];
+	
+	if (slot->region_count) {
+		vkCmdCopyBufferToImage(slot->command_buffer, slot->buffer, image,
+							   VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, slot->region_count, slot->regions);
+	}
+	
+	if (is_last_batch) {
+		VkImageMemoryBarrier image_barrier = {VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER};
+		image_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		image_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		image_barrier.image = image;
+		image_barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		image_barrier.subresourceRange.levelCount = 1;
+		image_barrier.subresourceRange.layerCount = 1;
+		image_barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		image_barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+		image_barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+		image_barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
 		
-		VkCommandBufferAllocateInfo command_buffer = {VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO};
-		command_buffer.commandPool = vk.command_pool;
-		command_buffer.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-		command_buffer.commandBufferCount = 1;
-		vkAllocateCommandBuffers(vk.device, &command_buffer, &vk.command_buffer);
+		vkCmdPipelineBarrier(slot->command_buffer,
+							 VK_PIPELINE_STAGE_TRANSFER_BIT,
+							 VK_PIPELINE_STAGE_TRANSFER_BIT,
+							 0,
+							 0, NULL,
+							 0, NULL,
+							 1, &image_barrier
+							 );
+		
+		VkBufferImageCopy buffer_copy = {0};
+		buffer_copy.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		buffer_copy.imageSubresource.layerCount = 1;
+		buffer_copy.imageExtent.width = image_width;
+		buffer_copy.imageExtent.height = image_height;
+		buffer_copy.imageExtent.depth = 1;
+		
+		vkCmdCopyImageToBuffer(slot->command_buffer, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+							   vk.readback_buffer, 1, &buffer_copy);
+		
+		VkMemoryBarrier host_barrier = {VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+		host_barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		host_barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+		
+		vkCmdPipelineBarrier(slot->command_buffer,
+							 VK_PIPELINE_STAGE_TRANSFER_BIT,
+							 VK_PIPELINE_STAGE_HOST_BIT,
+							 0,
+							 1, &host_barrier,
+							 0, NULL,
+							 0, NULL
+							 );
 	}
 	
-	// Fence
-	{
-		VkFenceCreateInfo fence = {VK_STRUCTURE_TYPE_FENCE_CREATE_INFO};
-		vkCreateFence(vk.device, &fence, NULL, &vk.fence);
+	VK_CHECK(vkEndCommandBuffer(slot->command_buffer));
+	
+	VkSubmitInfo submit = {VK_STRUCTURE_TYPE_SUBMIT_INFO};
+	submit.commandBufferCount = 1;
+	submit.pCommandBuffers = &slot->command_buffer;
+	
+	VK_CHECK(vkQueueSubmit(vk.queue, 1, &submit, slot->fence));
+	slot->in_flight = 1;
+	
+	vk.current_staging_slot = (vk.current_staging_slot + 1) % STAGING_SLOT_COUNT;
+}
+
+// Returns staging memory for a width * height glyph bitmap and queues its
+// copy to (x, y) in the atlas. When the current slot is full it is submitted
+// and rasterization carries on in the other slot.
+static uint8_t *stage_glyph_copy(VkImage image, int x, int y, int width, int height) {
+	struct staging_slot *slot = &vk.staging_slots[vk.current_staging_slot];
+	VkDeviceSize size = (VkDeviceSize)width * height;
+	
+	if (slot->used + size > slot->size || slot->region_count == MAX_COPY_REGIONS_PER_BATCH) {
+		submit_staging_batch(image, 0, 0, 0);
+		begin_staging_batch(image);
+		slot = &vk.staging_slots[vk.current_staging_slot];
 	}
 	
-	// Staging buffer
-	{
-		VkBufferCreateInfo buffer = {VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO};
-		buffer.size = staging_buffer_size;
-		buffer.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT|VK_BUFFER_USAGE_TRANSFER_DST_BIT;
-		buffer.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	VkBufferImageCopy *region = &slot->regions[slot->region_count++];
+	memset(region, 0, sizeof(*region));
+	region->bufferOffset = slot->used;
+	region->imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	region->imageSubresource.layerCount = 1;
+	region->imageOffset.x = x;
+	region->imageOffset.y = y;
+	region->imageExtent.width = width;
+	region->imageExtent.height = height;
+	region->imageExtent.depth = 1;
+	
+	// Buffer offsets of copy regions need to be 4 byte aligned.
+	slot->used = (slot->used + size + 3) & ~(VkDeviceSize)3;
+	
+	return slot->pointer + region->bufferOffset;
+}
+
+// Returns one past the largest codepoint the map type can hold.
+static uint32_t get_char_code_end(int type) {
+	switch (type) {
+		case MAP_TYPE_UTF16: return 16384;
+		case MAP_TYPE_ASCII: return 256;
+		case MAP_TYPE_UTF16_MAPPED: return 0x10000;
+		default: return UNICODE_CODEPOINT_COUNT;
+	}
+}
+
+// Returns the number of glyph structures in maps indexed directly by
+// unicode value, or 0 for the mapped map types.
+static int get_direct_frame_count(int type) {
+	switch (type) {
+		case MAP_TYPE_UTF16: return 16384;
+		case MAP_TYPE_ASCII: return 256;
+		default: return 0;
+	}
+}
+
+// Writes the glyph map that follows the header. char_codes is only used by
+// the mapped map types.
+static void write_glyph_map(FILE *file, int type, const uint32_t *char_codes,
+							const struct bfa_glyph *frames, int frame_count) {
+	switch (type) {
+		case MAP_TYPE_UTF16_MAPPED:
+		for (int i = 0; i < frame_count; ++i) {
+			uint16_t char_code = char_codes[i];
+			fwrite(&char_code, sizeof(char_code), 1, file);
+		}
+		break;
 		
-		vkCreateBuffer(vk.device, &buffer, NULL, &vk.staging_buffer);
+		case MAP_TYPE_UNICODE_MAPPED:
+		fwrite(char_codes, frame_count * sizeof(uint32_t), 1, file);
+		break;
+	}
+	
+	fwrite(frames, frame_count * sizeof(struct bfa_glyph), 1, file);
+}
+
+static void write_tga_file(const uint8_t *image, int width, int height) {
+	typedef struct {
+		uint8_t id_field_length;
+		uint8_t color_map_type;
+		uint8_t image_type;
+		uint8_t color_map_spec[5];
+		uint16_t x_origin;
+		uint16_t y_origin;
+		uint16_t width;
+		uint16_t height;
+		uint8_t pixel_size;
+		uint8_t image_descriptor;
+		uint8_t image_data[];
+	} TGA_Header;
+	
+	TGA_Header tga = {0};
+	tga.image_type = 2;
+	tga.width = width;
+	tga.height = height;
+	tga.pixel_size = 32;
+	tga.image_descriptor = 0x28;
+	
+	FILE *test_tga = fopen(tga_file_name, "wb");
+	fwrite(&tga, sizeof(tga), 1, test_tga);
+	for (int y = 0; y < height; ++y) {
+		for (int x = 0; x < width; ++x) {
+			uint32_t pixel = image[(y * width) + x];
+			pixel <<= 24; // Shift the value to alpha
+			fwrite(&pixel, 4, 1, test_tga);
+		}
+	}
+	fclose(test_tga);
+}
+
+// Walks the font's charmap instead of probing every value, so sparse
+// fonts and the supplementary planes cost only what they contain.
+static void enumerate_char_codes(FT_Face ft_face, uint32_t char_code_end, struct char_map *map) {
+	FT_UInt glyph_index;
+	FT_ULong char_code = FT_Get_First_Char(ft_face, &glyph_index);
+	
+	memset(map, 0, sizeof(*map));
+	
+	for (; glyph_index; char_code = FT_Get_Next_Char(ft_face, char_code, &glyph_index)) {
+		if (char_code >= char_code_end) break;
 		
-		VkMemoryRequirements memory_requirements;
-		VkMemoryAllocateInfo memory_allocation = {VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO};
-		vkGetBufferMemoryRequirements(vk.device, vk.staging_buffer, &memory_requirements);
-		memory_allocation.allocationSize = memory_requirements.size;
-		memory_allocation.memoryTypeIndex = vk.memory_type_indices[MEMORY_TYPE_CPU];
+		if (map->count == map->capacity) {
+			map->capacity = map->capacity ? map->capacity * 2 : 256;
+			map->char_codes = xrealloc(map->char_codes, map->capacity * sizeof(uint32_t));
+			map->glyph_indices = xrealloc(map->glyph_indices, map->capacity * sizeof(uint32_t));
+		}
 		
-		vkAllocateMemory(vk.device, &memory_allocation, NULL, &vk.staging_buffer_memory);
-		vkBindBufferMemory(vk.device, vk.staging_buffer, vk.staging_buffer_memory, 0);
-		vkMapMemory(vk.device, vk.staging_buffer_memory, 0, VK_WHOLE_SIZE, 0, &vk.staging_buffer_pointer);
+		map->char_codes[map->count] = char_code;
+		map->glyph_indices[map->count] = glyph_index;
+		map->count++;
 	}
 }
 
+struct weighted_glyph {
+	uint32_t weight;
+	int index;
+};
+
+static int compare_weighted_glyphs(const void *a, const void *b) {
+	const struct weighted_glyph *glyph_a = a;
+	const struct weighted_glyph *glyph_b = b;
+	
+	if (glyph_a->weight != glyph_b->weight) return glyph_a->weight < glyph_b->weight ? 1 : -1;
+	return glyph_a->index - glyph_b->index;
+}
+
+// Returns the order glyphs are placed in the atlas as indices into the char map.
+// Without a frequency profile this is codepoint order. With one, glyphs are
+// sorted by descending weight so the common ones share the first atlas rows.
+//
+// The profile is a text file with one "<codepoint> <weight>" pair per line.
+// Codepoints are decimal unless they start with 0x or U+, leading zeros don't
+// make them octal. Lines starting with # are ignored
+// and codepoints missing from the profile have a weight of 0.
+static int *get_placement_order(const struct char_map *map) {
+	struct weighted_glyph *glyphs = xmalloc(map->count * sizeof(*glyphs));
+	int *order = xmalloc(map->count * sizeof(*order));
+	
+	for (int i = 0; i < map->count; ++i) {
+		glyphs[i].weight = 0;
+		glyphs[i].index = i;
+	}
+	
+	if (frequency_profile_path) {
+		FILE *profile = fopen(frequency_profile_path, "r");
+		char line[256];
+		int line_number = 0;
+		
+		if (!profile) {
+			perror("Failed to open frequency profile");
+			exit(1);
+		}
+		
+		while (fgets(line, sizeof(line), profile)) {
+			char *cursor = line;
+			char *end;
+			unsigned long char_code;
+			unsigned long weight;
+			
+			line_number++;
+			while (*cursor == ' ' || *cursor == '\t') cursor++;
+			if (*cursor == '#' || *cursor == '\n' || *cursor == '\r' || !*cursor) continue;
+			
+			int base = 10;
+			if (((cursor[0] == 'U' || cursor[0] == 'u') && cursor[1] == '+') ||
+				(cursor[0] == '0' && (cursor[1] == 'x' || cursor[1] == 'X'))) {
+				cursor += 2;
+				base = 16;
+			}
+			
+			// strtoul would also skip whitespace and take a sign.
+			int is_digit = (*cursor >= '0' && *cursor <= '9') ||
+				(base == 16 && ((*cursor >= 'a' && *cursor <= 'f') || (*cursor >= 'A' && *cursor <= 'F')));
+			if (!is_digit) {
+				printf("%s:%d: Expected a codepoint\n", frequency_profile_path, line_number);
+				exit(1);
+			}
+			char_code = strtoul(cursor, &end, base);
+			
+			cursor = end;
+			int has_separator = *cursor == ' ' || *cursor == '\t';
+			while (*cursor == ' ' || *cursor == '\t') cursor++;
+			
+			if (!has_separator || *cursor < '0' || *cursor > '9') {
+				printf("%s:%d: Expected a weight after the codepoint\n", frequency_profile_path, line_number);
+				exit(1);
+			}
+			weight = strtoul(cursor, &end, 10);
+			
+			cursor = end;
+			while (*cursor == ' ' || *cursor == '\t' || *cursor == '\r' || *cursor == '\n') cursor++;
+			if (*cursor) {
+				printf("%s:%d: Unexpected text after the weight\n", frequency_profile_path, line_number);
+				exit(1);
+			}
+			
+			// The char map is sorted, so look the codepoint up with a binary search.
+			int low = 0;
+			int high = map->count - 1;
+			while (low <= high) {
+				int middle = (low + high) / 2;
+				if (map->char_codes[middle] == char_code) {
+					glyphs[middle].weight = weight > UINT32_MAX ? UINT32_MAX : (uint32_t)weight;
+					break;
+				}
+				if (map->char_codes[middle] < char_code) low = middle + 1;
+				else high = middle - 1;
+			}
+		}
+		
+		fclose(profile);
+		qsort(glyphs, map->count, sizeof(*glyphs), compare_weighted_glyphs);
+	}
+	
+	for (int i = 0; i < map->count; ++i) order[i] = glyphs[i].index;
+	
+	free(glyphs);
+	return order;
+}
+
+// Renders a glyph into the FreeType glyph slot and fills in the size, metrics
+// and flags of its frame, the caller places it in the atlas. Returns 0 for
+// glyphs such as " " that don't have an image, these shouldn't be rendered but
+// the frame needs to be kept for the advance metric.
+static int render_glyph(FT_Face ft_face, uint32_t glyph_index, struct bfa_glyph *frame) {
+	FT_GlyphSlot glyph_slot = ft_face->glyph;
+	
+	FT_Load_Glyph(ft_face, glyph_index, 0);
+	FT_Render_Glyph(glyph_slot, FT_RENDER_MODE_NORMAL);
+	
+	frame->w = glyph_slot->bitmap.width;
+	frame->h = glyph_slot->bitmap.rows;
+	frame->x_bearing = glyph_slot->metrics.horiBearingX >> 6;
+	frame->y_bearing = glyph_slot->metrics.horiBearingY >> 6;
+	frame->advance = glyph_slot->metrics.horiAdvance >> 6;
+	
+	if (!frame->w || !frame->h) {
+		frame->flags |= GLYPH_FLAGS_IS_SPACE;
+		return 0;
+	}
+	
+	return 1;
+}
+
 static void create_bfa_file(FT_Face ft_face, FILE *output_file) {
 	int total_glyph_count = 0;
-	int width_accumulator = 0;
+	int current_atlas_x = 0;
 	int output_width = 0;
 	int output_height = 0;
 	int row_height = 0;
@@ -188,19 +754,39 @@ static void create_bfa_file(FT_Face ft_face, FILE *output_file) {
 	uint16_t largest_glyph_height = 0;
 	FT_GlyphSlot glyph_slot = ft_face->glyph;
 	int atlas_row_count = 1;
-	const int char_code_max = map_type == MAP_TYPE_ASCII ? 256 : 16384;
+	struct char_map char_map;
+	uint32_t char_code_end;
+	int frame_count;
+	int *placement_order;
+	
+	char_code_end = get_char_code_end(map_type);
+	enumerate_char_codes(ft_face, char_code_end, &char_map);
+	
+	if (char_map.count > MAX_GLYPH_COUNT) {
+		printf("The font maps %d characters but at most %d fit in a .bfa file\n",
+			   char_map.count, MAX_GLYPH_COUNT);
+		exit(1);
+	}
+	
+	placement_order = get_placement_order(&char_map);
 	
 	// ===========================================================================
-	// Calculate the size of the output image
+	// Calculate the size of the output image. The rows are filled the same way
+	// as when the glyphs are placed below.
 	// ===========================================================================
-	for (int char_code = 0; char_code < char_code_max; ++char_code) {
-		uint32_t glyph_index = FT_Get_Char_Index(ft_face, char_code);
-		if (!glyph_index) continue;
+	for (int i = 0; i < char_map.count; ++i) {
+		uint32_t glyph_index = char_map.glyph_indices[placement_order[i]];
 		
 		FT_Load_Glyph(ft_face, glyph_index, 0);
 		FT_Render_Glyph(glyph_slot, FT_RENDER_MODE_NORMAL);
 		
-		width_accumulator += glyph_slot->bitmap.width;
+		if ((current_atlas_x + (int)glyph_slot->bitmap.width) > max_image_width) {
+			current_atlas_x = 0;
+			output_width = max_image_width;
+			atlas_row_count++;
+		}
+		
+		current_atlas_x += glyph_slot->bitmap.width;
 		
 		if (glyph_slot->bitmap.rows > row_height) {
 			row_height = glyph_slot->bitmap.rows;
@@ -209,16 +795,10 @@ static void create_bfa_file(FT_Face ft_face, FILE *output_file) {
 		
 		if (glyph_slot->bitmap.width > largest_glyph_width) largest_glyph_width = glyph_slot->bitmap.width;
 		
-		if (width_accumulator > max_image_width) {
-			width_accumulator = 0;
-			output_width = max_image_width;
-			atlas_row_count++;
-		}
-		
 		++total_glyph_count;
 	}
 	
-	if (!output_width) output_width = width_accumulator;
+	if (!output_width) output_width = current_atlas_x;
 	output_height = row_height * atlas_row_count;
 	
 	if (output_height > max_image_height) {
@@ -231,7 +811,7 @@ static void create_bfa_file(FT_Face ft_face, FILE *output_file) {
 	printf("Height: %d\n", output_height);
 	printf("Total texture size: %g MB\n", (double)(output_height * output_width) / (double)(1<<20));
 	
-	init_vulkan_context(output_width * output_height);
+	init_vulkan_context(output_width, output_height, (VkDeviceSize)largest_glyph_width * largest_glyph_height);
 	
 	VkImage output_image;
 	VkDeviceMemory output_image_memory;
@@ -252,158 +832,77 @@ static void create_bfa_file(FT_Face ft_face, FILE *output_file) {
 		image.tiling = VK_IMAGE_TILING_OPTIMAL;
 		image.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT|VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
 		
-		vkCreateImage(vk.device, &image, NULL, &output_image);
+		VK_CHECK(vkCreateImage(vk.device, &image, NULL, &output_image));
 		
 		VkMemoryRequirements memory_requirements;
-		VkMemoryAllocateInfo memory_allocation = {VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO};
 		vkGetImageMemoryRequirements(vk.device, output_image, &memory_requirements);
-		memory_allocation.allocationSize = memory_requirements.size;
-		memory_allocation.memoryTypeIndex = vk.memory_type_indices[MEMORY_TYPE_GPU];
+		allocate_memory(&memory_requirements, MEMORY_TYPE_GPU, &output_image_memory);
 		
-		vkAllocateMemory(vk.device, &memory_allocation, NULL, &output_image_memory);
-		vkBindImageMemory(vk.device, output_image, output_image_memory, 0);
+		VK_CHECK(vkBindImageMemory(vk.device, output_image, output_image_memory, 0));
 	}
 	
 	// ===========================================================================
-	// First issue commands to copy all rendered glyphs onto a target image
+	// Rasterize the glyphs into the staging slots. Full slots are copied onto
+	// the target image in one batch while the next slot is being filled.
 	// ===========================================================================
+	frame_count = get_direct_frame_count(map_type);
+	if (!frame_count) frame_count = char_map.count;
 	
-	VkImageMemoryBarrier image_barrier = {VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER};
-	image_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-	image_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-	image_barrier.image = output_image;
-	image_barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-	image_barrier.subresourceRange.levelCount = 1;
-	image_barrier.subresourceRange.layerCount = 1;
-	
-	VkBufferImageCopy buffer_copy = {0};
-	buffer_copy.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-	buffer_copy.imageSubresource.layerCount = 1;
-	buffer_copy.imageExtent.depth = 1;
-	
-	VkCommandBufferBeginInfo begin = {VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO};
-	vkBeginCommandBuffer(vk.command_buffer, &begin);
-	
-	image_barrier.srcAccessMask = 0;
-	image_barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-	image_barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-	image_barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-	
-	vkCmdPipelineBarrier(vk.command_buffer,
-							 VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
-							 VK_PIPELINE_STAGE_TRANSFER_BIT,
-							 0,
-							 0, NULL,
-							 0, NULL,
-							 1, &image_barrier
-							 );
-	
-	static struct bfa_glyph output_frames[16384];
-	static uint16_t unicode_to_glyph_map[16384];
+	struct bfa_glyph *output_frames = xcalloc(frame_count, sizeof(struct bfa_glyph));
+
 	int current_atlas_row = 0;
-	int glyphs_written = 0;
 	
-	for (int char_code = 0; char_code < char_code_max; ++char_code) {
-		uint32_t glyph_index = FT_Get_Char_Index(ft_face, char_code);
-		int width;
-		int height;
-		struct bfa_glyph *frame = 
-			&output_frames[map_type == MAP_TYPE_UTF16_MAPPED ? glyphs_written : char_code];
-		
-		if (!glyph_index) continue;
-		
-		FT_Load_Glyph(ft_face, glyph_index, 0);
-		FT_Render_Glyph(glyph_slot, FT_RENDER_MODE_NORMAL);
-		
-		width = glyph_slot->bitmap.width;
-		height = glyph_slot->bitmap.rows;
+	current_atlas_x = 0;
+	begin_staging_batch(output_image);
+	
+	for (int i = 0; i < char_map.count; ++i) {
+		int char_map_index = placement_order[i];
+		uint32_t char_code = char_map.char_codes[char_map_index];
+		uint32_t glyph_index = char_map.glyph_indices[char_map_index];
+		int is_mapped = map_type == MAP_TYPE_UTF16_MAPPED || map_type == MAP_TYPE_UNICODE_MAPPED;
+		struct bfa_glyph *frame = &output_frames[is_mapped ? char_map_index : (int)char_code];
+		int has_image = render_glyph(ft_face, glyph_index, frame);
+		int width = frame->w;
+		int height = frame->h;
 		
-		if ((buffer_copy.imageOffset.x + width) > output_width) {
-			buffer_copy.imageOffset.x = 0;
+		if ((current_atlas_x + width) > output_width) {
+			current_atlas_x = 0;
 			current_atlas_row++;
 		}
 		
-		frame->x = buffer_copy.imageOffset.x;
+		frame->x = current_atlas_x;
 		frame->y = current_atlas_row * row_height;
-		frame->w = width;
-		frame->h = height;
-		frame->x_bearing = glyph_slot->metrics.horiBearingX >> 6;
-		frame->y_bearing = glyph_slot->metrics.horiBearingY >> 6;
-		frame->advance = glyph_slot->metrics.horiAdvance >> 6;
-		
-		unicode_to_glyph_map[glyphs_written] = char_code;
-		glyphs_written++;
 		
-		// Some glyphs such as " " don't have an image so these 
-		// shouldn't be rendered. But the frame needs to be kept for the advance metric.
-		if (!width || !height) {
-			frame->flags |= 0x1;
-			continue;
-		}
+		if (!has_image) continue;
 		
 		memcpy(
-				   (uint8_t*)vk.staging_buffer_pointer + buffer_copy.bufferOffset,
-				   glyph_slot->bitmap.buffer,
-				   width * height
-				   );
+			   stage_glyph_copy(output_image, frame->x, frame->y, width, height),
+			   glyph_slot->bitmap.buffer,
+			   width * height
+			   );
 		
-		buffer_copy.imageOffset.y = current_atlas_row * row_height;
-		buffer_copy.imageExtent.width = width;
-		buffer_copy.imageExtent.height = height;
-		
-		vkCmdCopyBufferToImage(vk.command_buffer, vk.staging_buffer, output_image, 
-							   VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &buffer_copy);
-		
-		buffer_copy.imageOffset.x += width;
-		buffer_copy.bufferOffset += width * height;
+		current_atlas_x += width;
 	}
 	
-	image_barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-	image_barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-	image_barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-	image_barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-	
-	vkCmdPipelineBarrier(vk.command_buffer,
-						 VK_PIPELINE_STAGE_TRANSFER_BIT,
-						 VK_PIPELINE_STAGE_TRANSFER_BIT,
-						 0,
-						 0, NULL,
-						 0, NULL,
-						 1, &image_barrier
-						 );
-	
-	vkEndCommandBuffer(vk.command_buffer);
-	
-	VkSubmitInfo submit = {VK_STRUCTURE_TYPE_SUBMIT_INFO};
-	submit.commandBufferCount = 1;
-	submit.pCommandBuffers = &vk.command_buffer;
-	
-	vkQueueSubmit(vk.queue, 1, &submit, vk.fence);
-	vkWaitForFences(vk.device, 1, &vk.fence, VK_TRUE, UINT64_MAX);
-	vkResetFences(vk.device, 1, &vk.fence);
-	
-	const uint32_t final_output_image_size = output_width * output_height;
-	
 	// ===========================================================================
-	// Now copy the image back to CPU memory for writing to the output file
+	// The last batch also copies the image back to CPU memory for writing to
+	// the output file, so this is the only time we need to wait on the GPU.
 	// ===========================================================================
-	vkBeginCommandBuffer(vk.command_buffer, &begin);
-	
-	buffer_copy.imageOffset.x = 0;
-	buffer_copy.imageOffset.y = 0;
-	buffer_copy.imageExtent.width = output_width;
-	buffer_copy.imageExtent.height = output_height;
-	buffer_copy.bufferOffset = 0;
+	submit_staging_batch(output_image, 1, output_width, output_height);
 	
-	vkCmdCopyImageToBuffer(vk.command_buffer, output_image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, 
-							   vk.staging_buffer, 1, &buffer_copy);
-	
-	vkEndCommandBuffer(vk.command_buffer);
-	
-	vkQueueSubmit(vk.queue, 1, &submit, vk.fence);
-	vkWaitForFences(vk.device, 1, &vk.fence, VK_TRUE, UINT64_MAX);
-	vkResetFences(vk.device, 1, &vk.fence);
+	{
+		VkFence fences[STAGING_SLOT_COUNT];
+		uint32_t fence_count = 0;
+		
+		for (int i = 0; i < STAGING_SLOT_COUNT; ++i) {
+			if (vk.staging_slots[i].in_flight) fences[fence_count++] = vk.staging_slots[i].fence;
+		}
+		
+		VK_CHECK(vkWaitForFences(vk.device, fence_count, fences, VK_TRUE, UINT64_MAX));
+	}
 	
+	const uint32_t final_output_image_size = output_width * output_height;
+
 	// ===========================================================================
 	// Finally, write the result to the output file
 	// ===========================================================================
@@ -420,58 +919,416 @@ static void create_bfa_file(FT_Face ft_face, FILE *output_file) {
 	header.size_of_stored_image_data = final_output_image_size;
 	
 	fwrite(&header, sizeof(header), 1, output_file);
-	switch (map_type) {
-		case MAP_TYPE_UTF16:
-		fwrite(output_frames, 16384 * sizeof(struct bfa_glyph), 1, output_file);
-		break;
+	write_glyph_map(output_file, map_type, char_map.char_codes, output_frames, frame_count);
+	fwrite(vk.readback_buffer_pointer, final_output_image_size, 1, output_file);
+	
+	// ===========================================================================
+	// Optionally write the output image to a TGA file for debugging
+	// ===========================================================================
+	if (tga_file_name) {
+		write_tga_file(vk.readback_buffer_pointer, output_width, output_height);
+	}
+	
+	free(output_frames);
+	free(placement_order);
+	free(char_map.char_codes);
+	free(char_map.glyph_indices);
+}
+
+static int compare_ints(const void *a, const void *b) {
+	int int_a = *(const int*)a;
+	int int_b = *(const int*)b;
+	return (int_a > int_b) - (int_a < int_b);
+}
+
+// Recovers the atlas rows from the recorded glyph rectangles. Every distinct
+// glyph y starts a shelf that reaches down to the next one and is free to the
+// right of its last glyph.
+static struct atlas_shelf *find_atlas_shelves(const struct bfa_glyph *frames, int frame_count,
+											  int atlas_height, int *shelf_count) {
+	int *row_starts = xmalloc(frame_count * sizeof(int));
+	struct atlas_shelf *shelves = xmalloc(frame_count * sizeof(struct atlas_shelf));
+	int row_start_count = 0;
+	
+	for (int i = 0; i < frame_count; ++i) {
+		if (frames[i].w && frames[i].h) row_starts[row_start_count++] = frames[i].y;
+	}
+	
+	qsort(row_starts, row_start_count, sizeof(int), compare_ints);
+	
+	*shelf_count = 0;
+	for (int i = 0; i < row_start_count; ++i) {
+		if (*shelf_count && shelves[*shelf_count - 1].y == row_starts[i]) continue;
+		shelves[*shelf_count].y = row_starts[i];
+		shelves[*shelf_count].free_x = 0;
+		(*shelf_count)++;
+	}
+	
+	for (int i = 0; i < *shelf_count; ++i) {
+		int next_y = i + 1 < *shelf_count ? shelves[i + 1].y : atlas_height;
+		shelves[i].height = next_y - shelves[i].y;
+	}
+	
+	for (int i = 0; i < frame_count; ++i) {
+		const struct bfa_glyph *frame = &frames[i];
+		if (!frame->w || !frame->h) continue;
 		
-		case MAP_TYPE_ASCII:
-		fwrite(output_frames, 256 * sizeof(struct bfa_glyph), 1, output_file);
-		break;
+		int low = 0;
+		int high = *shelf_count - 1;
+		while (low < high) {
+			int middle = (low + high + 1) / 2;
+			if (shelves[middle].y <= frame->y) low = middle;
+			else high = middle - 1;
+		}
 		
-		case MAP_TYPE_UTF16_MAPPED:
-		fwrite(unicode_to_glyph_map, glyphs_written * 2, 1, output_file);
-		fwrite(output_frames, glyphs_written * sizeof(struct bfa_glyph), 1, output_file);
-		break;
+		if (frame->x + frame->w > shelves[low].free_x) shelves[low].free_x = frame->x + frame->w;
+	}
+	
+	free(row_starts);
+	return shelves;
+}
+
+// Writes data at the given offset of a file that is being updated, exits when
+// that fails so a half written file is reported.
+static void write_at(FILE *file, long offset, const void *data, size_t size, const char *path) {
+	if (fseek(file, offset, SEEK_SET) || (size && fwrite(data, size, 1, file) != 1)) {
+		printf("Failed to write \"%s\"\n", path);
+		exit(1);
+	}
+}
+
+// Rasterizes the codepoints of the font that are missing from an existing
+// .bfa file into the free space of its atlas. Existing glyphs keep their
+// place, and the atlas only grows when the new glyphs don't fit.
+//
+// When the layout of the file allows it, only the header, the glyph map and
+// the changed image rows are written back. Otherwise the file is rewritten.
+static void append_to_bfa_file(FT_Face ft_face, const char *path) {
+	FILE *file = fopen(path, "rb");
+	struct bfa_header header;
+	FT_GlyphSlot glyph_slot = ft_face->glyph;
+	struct char_map char_map;
+	struct char_map missing;
+	uint32_t *char_codes = NULL;
+	struct bfa_glyph *frames;
+	int frame_count;
+	uint8_t *image;
+	
+	if (!file) {
+		perror("Failed to open file to append to");
+		exit(1);
 	}
-	fwrite(vk.staging_buffer_pointer, final_output_image_size, 1, output_file);
 	
 	// ===========================================================================
-	// Optionally write the output image to a TGA file for debugging
+	// Load the existing file
 	// ===========================================================================
-	if (tga_file_name) {
-		typedef struct {
-			uint8_t id_field_length;
-			uint8_t color_map_type;
-			uint8_t image_type;
-			uint8_t color_map_spec[5];
-			uint16_t x_origin;
-			uint16_t y_origin;
-			uint16_t width;
-			uint16_t height;
-			uint8_t pixel_size;
-			uint8_t image_descriptor;
-			uint8_t image_data[];
-		} TGA_Header;
-		
-		TGA_Header tga = {0};
-		tga.image_type = 2;
-		tga.width = output_width;
-		tga.height = output_height;
-		tga.pixel_size = 32;
-		tga.image_descriptor = 0x28;
-		
-		FILE *test_tga = fopen(tga_file_name, "wb");
-		fwrite(&tga, sizeof(tga), 1, test_tga);
-		for (int y = 0; y < output_height; ++y) {
-			for (int x = 0; x < output_width; ++x) {
-				uint32_t pixel = ((uint8_t*)vk.staging_buffer_pointer)[(y * output_width) + x];
-				pixel <<= 24; // Shift the value to alpha
-				fwrite(&pixel, 4, 1, test_tga);
+	if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != *(uint32_t*)".bfa" ||
+		header.map_type > MAP_TYPE_UNICODE_MAPPED) {
+		printf("\"%s\" is not a valid .bfa file\n", path);
+		exit(1);
+	}
+	
+	if (header.font_size != requested_font_size) {
+		printf("\"%s\" was baked at font size %d, not %d\n", path, header.font_size, requested_font_size);
+		exit(1);
+	}
+	
+	map_type = header.map_type;
+	frame_count = get_direct_frame_count(map_type);
+	if (!frame_count) frame_count = header.glyph_count;
+	
+	const long image_data_offset = ftell(file) +
+		(map_type == MAP_TYPE_UTF16_MAPPED ? frame_count * sizeof(uint16_t) : 0) +
+		(map_type == MAP_TYPE_UNICODE_MAPPED ? frame_count * sizeof(uint32_t) : 0) +
+		frame_count * sizeof(struct bfa_glyph);
+	const int old_atlas_width = header.atlas_width;
+	const uint32_t old_stored_image_size = header.size_of_stored_image_data;
+	int atlas_width = header.atlas_width;
+	int atlas_height = header.atlas_height;
+	
+	if (old_stored_image_size > (uint32_t)atlas_width * atlas_height) {
+		printf("\"%s\" is not a valid .bfa file\n", path);
+		exit(1);
+	}
+	
+	// The size limits only apply to growing the atlas, so an existing atlas
+	// that is already larger than them can still be appended to.
+	if (max_image_width < atlas_width) max_image_width = atlas_width;
+	if (max_image_height < atlas_height) max_image_height = atlas_height;
+	
+	frames = xmalloc(frame_count * sizeof(struct bfa_glyph));
+	char_codes = xmalloc(frame_count * sizeof(uint32_t));
+	image = xcalloc((size_t)atlas_width * atlas_height, 1);
+	
+	int read_ok = 1;
+	if (map_type == MAP_TYPE_UTF16_MAPPED) {
+		for (int i = 0; i < frame_count && read_ok; ++i) {
+			uint16_t char_code;
+			read_ok = fread(&char_code, sizeof(char_code), 1, file) == 1;
+			char_codes[i] = char_code;
+		}
+	}
+	else if (map_type == MAP_TYPE_UNICODE_MAPPED) {
+		read_ok = fread(char_codes, sizeof(uint32_t), frame_count, file) == (size_t)frame_count;
+	}
+	
+	if (!read_ok ||
+		fread(frames, sizeof(struct bfa_glyph), frame_count, file) != (size_t)frame_count ||
+		fread(image, 1, old_stored_image_size, file) != old_stored_image_size) {
+		printf("\"%s\" is truncated\n", path);
+		exit(1);
+	}
+	fclose(file);
+	
+	// ===========================================================================
+	// Find the codepoints of the font that the file doesn't have yet
+	// ===========================================================================
+	enumerate_char_codes(ft_face, get_char_code_end(map_type), &char_map);
+	
+	memset(&missing, 0, sizeof(missing));
+	missing.char_codes = xmalloc(char_map.count * sizeof(uint32_t));
+	missing.glyph_indices = xmalloc(char_map.count * sizeof(uint32_t));
+	
+	// Both code lists are sorted, so they can be walked together.
+	for (int i = 0, existing = 0; i < char_map.count; ++i) {
+		uint32_t char_code = char_map.char_codes[i];
+		int is_missing;
+		
+		if (get_direct_frame_count(map_type)) {
+			const struct bfa_glyph *frame = &frames[char_code];
+			is_missing = !frame->w && !frame->h && !(frame->flags & GLYPH_FLAGS_IS_SPACE);
+		}
+		else {
+			while (existing < frame_count && char_codes[existing] < char_code) existing++;
+			is_missing = existing == frame_count || char_codes[existing] != char_code;
+		}
+		
+		if (is_missing) {
+			missing.char_codes[missing.count] = char_code;
+			missing.glyph_indices[missing.count] = char_map.glyph_indices[i];
+			missing.count++;
+		}
+	}
+	
+	printf("No. Glyphs: %d\n", header.glyph_count);
+	printf("No. Missing glyphs: %d\n", missing.count);
+	
+	if (!missing.count) return;
+	
+	if (header.glyph_count + missing.count > MAX_GLYPH_COUNT) {
+		printf("Appending %d glyphs would exceed the limit of %d glyphs in a .bfa file\n",
+			   missing.count, MAX_GLYPH_COUNT);
+		exit(1);
+	}
+	
+	// ===========================================================================
+	// Rasterize the missing glyphs into free atlas space
+	// ===========================================================================
+	int shelf_count;
+	struct atlas_shelf *shelves = find_atlas_shelves(frames, frame_count, atlas_height, &shelf_count);
+	struct bfa_glyph *new_frames = xcalloc(missing.count, sizeof(struct bfa_glyph));
+	int *placement_order = get_placement_order(&missing);
+	
+	// Rows of each shelf that received new glyphs, counted from the top of the shelf.
+	int *changed_shelf_rows = xcalloc(shelf_count + missing.count, sizeof(int));
+	
+	shelves = xrealloc(shelves, (shelf_count + missing.count) * sizeof(struct atlas_shelf));
+	
+	for (int i = 0; i < missing.count; ++i) {
+		int missing_index = placement_order[i];
+		struct bfa_glyph *frame = &new_frames[missing_index];
+		struct atlas_shelf *shelf = NULL;
+		int has_image = render_glyph(ft_face, missing.glyph_indices[missing_index], frame);
+		int width = frame->w;
+		int height = frame->h;
+		
+		if (width > header.largest_glyph_width) header.largest_glyph_width = width;
+		if (height > header.largest_glyph_height) header.largest_glyph_height = height;
+		
+		if (!has_image) continue;
+		
+		for (int j = 0; j < shelf_count; ++j) {
+			if (shelves[j].height >= height && shelves[j].free_x + width <= atlas_width) {
+				shelf = &shelves[j];
+				break;
+			}
+		}
+		
+		// No room left, grow the atlas by a new row at the bottom.
+		if (!shelf) {
+			int new_atlas_width = width > atlas_width ? width : atlas_width;
+			int row_height = height > header.largest_glyph_height ? height : header.largest_glyph_height;
+			int new_atlas_height = atlas_height + row_height;
+			
+			if (new_atlas_width > max_image_width || new_atlas_height > max_image_height ||
+				new_atlas_width > MAX_TEXTURE_DIMENSION || new_atlas_height > MAX_TEXTURE_DIMENSION) {
+				printf("Image is too large!! Try increasing --max-width and --max-height\n");
+				exit(1);
+			}
+			
+			uint8_t *new_image = xcalloc((size_t)new_atlas_width * new_atlas_height, 1);
+			for (int y = 0; y < atlas_height; ++y) {
+				memcpy(new_image + (size_t)y * new_atlas_width, image + (size_t)y * atlas_width, atlas_width);
+			}
+			free(image);
+			image = new_image;
+			
+			shelf = &shelves[shelf_count++];
+			shelf->y = atlas_height;
+			shelf->height = row_height;
+			shelf->free_x = 0;
+			
+			atlas_width = new_atlas_width;
+			atlas_height = new_atlas_height;
+		}
+		
+		frame->x = shelf->free_x;
+		frame->y = shelf->y;
+		shelf->free_x += width;
+		
+		for (int y = 0; y < height; ++y) {
+			memcpy(image + (size_t)(frame->y + y) * atlas_width + frame->x,
+				   glyph_slot->bitmap.buffer + y * glyph_slot->bitmap.pitch,
+				   width);
+		}
+		
+		int shelf_index = (int)(shelf - shelves);
+		if (height > changed_shelf_rows[shelf_index]) changed_shelf_rows[shelf_index] = height;
+	}
+	
+	// ===========================================================================
+	// Merge the new glyphs into the glyph map
+	// ===========================================================================
+	if (get_direct_frame_count(map_type)) {
+		for (int i = 0; i < missing.count; ++i) frames[missing.char_codes[i]] = new_frames[i];
+	}
+	else {
+		int merged_count = frame_count + missing.count;
+		uint32_t *merged_codes = xmalloc(merged_count * sizeof(uint32_t));
+		struct bfa_glyph *merged_frames = xmalloc(merged_count * sizeof(struct bfa_glyph));
+		
+		for (int i = 0, existing = 0, added = 0; i < merged_count; ++i) {
+			if (added == missing.count ||
+				(existing < frame_count && char_codes[existing] < missing.char_codes[added])) {
+				merged_codes[i] = char_codes[existing];
+				merged_frames[i] = frames[existing++];
+			}
+			else {
+				merged_codes[i] = missing.char_codes[added];
+				merged_frames[i] = new_frames[added++];
 			}
 		}
-		fclose(test_tga);
+		
+		free(char_codes);
+		free(frames);
+		char_codes = merged_codes;
+		frames = merged_frames;
+		frame_count = merged_count;
 	}
+	
+	header.glyph_count += missing.count;
+	header.atlas_width = atlas_width;
+	header.atlas_height = atlas_height;
+	
+	printf("Width: %d\n", atlas_width);
+	printf("Height: %d\n", atlas_height);
+	
+	// ===========================================================================
+	// Write the result. The direct map types keep their glyph map size, so as
+	// long as the atlas width is the same only the changed rows of each shelf
+	// are written.
+	// ===========================================================================
+	if (get_direct_frame_count(map_type) && atlas_width == old_atlas_width) {
+		size_t stored_image_size = old_stored_image_size;
+		
+		file = fopen(path, "r+b");
+		if (!file) {
+			perror("Failed to open file to append to");
+			exit(1);
+		}
+		
+		// The shelves are ordered by y, so the bands are written front to back.
+		for (int i = 0; i < shelf_count; ++i) {
+			if (!changed_shelf_rows[i]) continue;
+			
+			size_t band_start = (size_t)shelves[i].y * atlas_width;
+			size_t band_end = band_start + (size_t)changed_shelf_rows[i] * atlas_width;
+			
+			// Bytes past the stored image data are missing from the file, so
+			// the band has to start where the stored data ends.
+			if (band_start > stored_image_size) band_start = stored_image_size;
+			if (band_end > stored_image_size) stored_image_size = band_end;
+			
+			write_at(file, image_data_offset + (long)band_start, image + band_start,
+					 band_end - band_start, path);
+			
+			printf("Rewrote image rows %d to %d\n", shelves[i].y, shelves[i].y + changed_shelf_rows[i]);
+		}
+		
+		header.size_of_stored_image_data = (uint32_t)stored_image_size;
+		
+		write_at(file, 0, &header, sizeof(header), path);
+		write_glyph_map(file, map_type, char_codes, frames, frame_count);
+		
+		if (ferror(file) || fclose(file)) {
+			printf("Failed to write \"%s\"\n", path);
+			exit(1);
+		}
+	}
+	else {
+		// The whole file changes, so it is written next to the original and
+		// only replaces it once it is complete.
+		char *temp_path = xmalloc(strlen(path) + sizeof(".tmp"));
+		sprintf(temp_path, "%s.tmp", path);
+		
+		header.size_of_stored_image_data = atlas_width * atlas_height;
+		
+		file = fopen(temp_path, "wb");
+		if (!file) {
+			perror("Failed to open temporary file");
+			exit(1);
+		}
+		
+		write_at(file, 0, &header, sizeof(header), temp_path);
+		write_glyph_map(file, map_type, char_codes, frames, frame_count);
+		if (fwrite(image, header.size_of_stored_image_data, 1, file) != 1 || ferror(file)) {
+			fclose(file);
+			remove(temp_path);
+			printf("Failed to write \"%s\"\n", temp_path);
+			exit(1);
+		}
+		
+		if (fclose(file)) {
+			remove(temp_path);
+			printf("Failed to write \"%s\"\n", temp_path);
+			exit(1);
+		}
+		
+		// rename() doesn't replace an existing file on Windows.
+		if (rename(temp_path, path) && (remove(path) || rename(temp_path, path))) {
+			perror("Failed to replace the original file");
+			printf("The new file was left at \"%s\"\n", temp_path);
+			exit(1);
+		}
+		
+		free(temp_path);
+	}
+
+	if (tga_file_name) {
+		write_tga_file(image, atlas_width, atlas_height);
+	}
+	
+	free(image);
+	free(frames);
+	free(char_codes);
+	free(new_frames);
+	free(shelves);
+	free(changed_shelf_rows);
+	free(placement_order);
+	free(char_map.char_codes);
+	free(char_map.glyph_indices);
+	free(missing.char_codes);
+	free(missing.glyph_indices);
 }
 
 static void print_usage() {
@@ -485,7 +1342,11 @@ static void print_usage() {
 			   "                             avoiding empty space.\n"
 			   "    -h, --max-height <dimension>: Maximum height of the image (def. 8192).\n"
 			   "    -t, --output-tga <filename>: Quick and dirty output image to Targa file (overwrites if exists).\n"
-			   "    -m, --map-type <type>: The map type. Valid values: ascii, utf16, mapped (default).\n"
+			   "    -a, --append: Add the glyphs of the font that are missing from an existing <output> file.\n"
+			   "                             Existing glyphs keep their place and new ones go into free atlas space.\n"
+			   "    -f, --frequency-profile <filename>: Place glyphs in the atlas by descending weight so frequently\n"
+			   "                             used glyphs are close together. One \"<codepoint> <weight>\" per line.\n"
+			   "    -m, --map-type <type>: The map type. Valid values: ascii, utf16, mapped16, mapped (default).\n"
 		   );
 }
 
@@ -529,6 +1390,17 @@ int main(int argc, char **argv) {
 			}
 			tga_file_name = argv[1];
 		}
+		else if (!strcmp("--append", *argv) || !strcmp("-a", *argv)) {
+			append_mode = 1;
+		}
+		else if (!strcmp("--frequency-profile", *argv) || !strcmp("-f", *argv)) {
+			if (is_last_arg) {
+				printf("Expected path after --frequency-profile\n");
+				print_usage();
+				return 1;
+			}
+			frequency_profile_path = argv[1];
+		}
 		else if (!strcmp("--map-type", *argv) || !strcmp("-m", *argv)) {
 			if (is_last_arg) {
 				printf("Expected map type after --map-type\n");
@@ -541,9 +1413,12 @@ int main(int argc, char **argv) {
 			else if (!strcmp(argv[1], "utf16")) {
 				map_type = MAP_TYPE_UTF16;
 			}
-			else if (!strcmp(argv[1], "mapped")) {
+			else if (!strcmp(argv[1], "mapped16")) {
 				map_type = MAP_TYPE_UTF16_MAPPED;
 			}
+			else if (!strcmp(argv[1], "mapped")) {
+				map_type = MAP_TYPE_UNICODE_MAPPED;
+			}
 			else {
 				printf("Invalid map type \"%s\"\n", argv[1]);
 				return 1;
@@ -561,14 +1436,17 @@ int main(int argc, char **argv) {
 		return 1;
 	}
 	
-	FILE *output_file;
+	FILE *output_file = NULL;
 	FT_Library freetype;
 	FT_Face ft_face;
 	
-	output_file = fopen(output_path, "wb");
-	if (!output_file) {
-		perror("Failed to open output file");
-		return 1;
+	// The append mode reads the output file first and then updates it.
+	if (!append_mode) {
+		output_file = fopen(output_path, "wb");
+		if (!output_file) {
+			perror("Failed to open output file");
+			return 1;
+		}
 	}
 	
 	FT_Init_FreeType(&freetype);
@@ -585,7 +1463,12 @@ int main(int argc, char **argv) {
 	
 	FT_Set_Pixel_Sizes(ft_face, requested_font_size, 0);
 	
-	create_bfa_file(ft_face, output_file);
+	if (append_mode) {
+		append_to_bfa_file(ft_face, output_path);
+	}
+	else {
+		create_bfa_file(ft_face, output_file);
+	}
 	printf("Output written to %s\n", output_path);
 	
 	return 0;
@@ -24,13 +24,134 @@ struct bfa_header {
 	uint32_t size_of_stored_image_data;
 };
 
+// The runtime glyph table is split in two. Text layout reads the atlas
+// rectangle and the advance of every character, so those are packed into
+// 8 bytes (eight glyphs per cache line). The bearings and flags are only
+// needed when a glyph is drawn and live in a separate array.
+struct bfa_glyph_hot {
+	uint64_t x : 14;
+	uint64_t y : 14;
+	uint64_t w : 10;
+	uint64_t h : 10;
+	uint64_t advance : 16; // int16, read it through a cast.
+};
+
+struct bfa_glyph_cold {
+	int16_t x_bearing, y_bearing;
+	uint16_t flags;
+};
+
+typedef char bfa_glyph_hot_is_8_bytes[sizeof(struct bfa_glyph_hot) == 8 ? 1 : -1];
+
+struct bfa_runtime_table {
+	int glyph_count;
+	// Sorted unicode values for the mapped map types, NULL when the
+	// table is indexed directly by unicode value.
+	uint32_t *codes;
+	struct bfa_glyph_hot *hot;
+	struct bfa_glyph_cold *cold;
+};
+
 static const char *map_type_names[] = {
 	"utf16",
 	"ascii",
+	"mapped16",
 	"mapped"
 };
 
-static void print_glyph(struct bfa_glyph *glyph) {
+static void free_runtime_table(struct bfa_runtime_table *table) {
+	free(table->codes);
+	free(table->hot);
+	free(table->cold);
+}
+
+// Converts the on-disk glyph map into a runtime table. Prints the reason and
+// returns 0 on failure.
+static int build_runtime_table(const uint8_t *file_buffer, struct bfa_runtime_table *table) {
+	const struct bfa_header *header = (const struct bfa_header*)file_buffer;
+	const uint8_t *glyph_codes = NULL;
+	const struct bfa_glyph *glyphs;
+	size_t code_size = 0;
+	
+	switch (header->map_type) {
+		case 0: table->glyph_count = 16384; break;
+		case 1: table->glyph_count = 256; break;
+		case 2: table->glyph_count = header->glyph_count; code_size = sizeof(uint16_t); break;
+		case 3: table->glyph_count = header->glyph_count; code_size = sizeof(uint32_t); break;
+		default:
+		printf("Unknown map type %u\n", header->map_type);
+		return 0;
+	}
+	
+	glyph_codes = &file_buffer[sizeof(struct bfa_header)];
+	glyphs = (const struct bfa_glyph*)&glyph_codes[table->glyph_count * code_size];
+	
+	table->codes = code_size ? malloc(table->glyph_count * sizeof(uint32_t)) : NULL;
+	table->hot = malloc(table->glyph_count * sizeof(struct bfa_glyph_hot));
+	table->cold = malloc(table->glyph_count * sizeof(struct bfa_glyph_cold));
+	if ((code_size && !table->codes) || !table->hot || !table->cold) {
+		printf("Out of memory\n");
+		free_runtime_table(table);
+		return 0;
+	}
+	
+	for (int i = 0; i < table->glyph_count; ++i) {
+		const struct bfa_glyph *glyph = &glyphs[i];
+		
+		if (code_size == sizeof(uint16_t)) table->codes[i] = ((const uint16_t*)glyph_codes)[i];
+		if (code_size == sizeof(uint32_t)) table->codes[i] = ((const uint32_t*)glyph_codes)[i];
+		
+		// Glyphs without an image are never drawn, and their position can be
+		// right at the edge of a 16384 texel atlas, so it isn't kept.
+		int has_image = glyph->w && glyph->h;
+		
+		if (glyph->w >= (1 << 10) || glyph->h >= (1 << 10)) {
+			printf("Glyph %d is %ux%u, the runtime table supports at most 1023x1023\n",
+				   i, glyph->w, glyph->h);
+			free_runtime_table(table);
+			return 0;
+		}
+		
+		// Atlases can be up to 65535 texels wide, the packed position only
+		// covers the first 16384.
+		if (has_image && (glyph->x >= (1 << 14) || glyph->y >= (1 << 14))) {
+			printf("Glyph %d is at %u,%u, the runtime table supports atlas positions up to 16383\n",
+				   i, glyph->x, glyph->y);
+			free_runtime_table(table);
+			return 0;
+		}
+		
+		table->hot[i].x = has_image ? glyph->x : 0;
+		table->hot[i].y = has_image ? glyph->y : 0;
+		table->hot[i].w = glyph->w;
+		table->hot[i].h = glyph->h;
+		table->hot[i].advance = (uint16_t)glyph->advance;
+		
+		table->cold[i].x_bearing = glyph->x_bearing;
+		table->cold[i].y_bearing = glyph->y_bearing;
+		table->cold[i].flags = glyph->flags;
+	}
+	
+	return 1;
+}
+
+// Returns the index of the glyph in the runtime table or -1 if there is none.
+static int find_glyph(const struct bfa_runtime_table *table, uint32_t unicode) {
+	if (!table->codes) return unicode < (uint32_t)table->glyph_count ? (int)unicode : -1;
+	
+	int low = 0;
+	int high = table->glyph_count - 1;
+	while (low <= high) {
+		int middle = (low + high) / 2;
+		if (table->codes[middle] == unicode) return middle;
+		if (table->codes[middle] < unicode) low = middle + 1;
+		else high = middle - 1;
+	}
+	
+	return -1;
+}
+
+static void print_glyph(const struct bfa_glyph_hot *hot, const struct bfa_glyph_cold *cold) {
 	printf(
 		   "x: %u\n"
 		   "y: %u\n"
@@ -40,9 +161,9 @@ static void print_glyph(struct bfa_glyph *glyph) {
 		   "y bearing: %u\n"
 		   "advance: %u\n"
 		   "flags: 0x%x\n",
-		   glyph->x, glyph->y, glyph->w, glyph->h,
-		   glyph->x_bearing, glyph->y_bearing, glyph->advance,
-		   glyph->flags
+		   (unsigned)hot->x, (unsigned)hot->y, (unsigned)hot->w, (unsigned)hot->h,
+		   cold->x_bearing, cold->y_bearing, (int16_t)hot->advance,
+		   cold->flags
 		   );
 }
 
@@ -79,8 +200,8 @@ int main(int argc, char **argv) {
 	
 	// Get the glyph
 	struct bfa_header *header = (struct bfa_header*)file_buffer;
-	uint16_t *glyph_codes;
-	struct bfa_glyph *glyphs;
+	struct bfa_runtime_table table = {0};
+	int glyph_index;
 	
 	printf("File size: %u\n", file_buffer_size);
 	printf(
@@ -100,35 +221,23 @@ int main(int argc, char **argv) {
 			   header->size_of_stored_image_data / (double)(1<<20)
 			   );
 	
-	if (header->map_type == 2) {
-		glyph_codes = (uint16_t*)&file_buffer[sizeof(struct bfa_header)];
-		glyphs = (struct bfa_glyph*)&file_buffer[sizeof(struct bfa_header) + (header->glyph_count * sizeof(uint16_t))];
-		
-		for (int i = 0; i < header->glyph_count; ++i) {
-			if (glyph_codes[i] == input_unicode) {
-				struct bfa_glyph *glyph = &glyphs[i];
-				print_glyph(glyph);
-				goto END;
-			}
-		}
-		
+	if (!build_runtime_table(file_buffer, &table)) {
+		return 1;
+	}
+	
+	glyph_index = find_glyph(&table, input_unicode);
+	if (glyph_index >= 0) {
+		print_glyph(&table.hot[glyph_index], &table.cold[glyph_index]);
+	}
+	else if (table.codes) {
 		printf("Glyph not found\n");
 	}
 	else {
-		int max_unicode = header->map_type == 0 ? 0xffff : 0xff;
-		
-		if (input_unicode > max_unicode) {
-			printf("Unicode value 0x%x out of range.\n", input_unicode);
-			return 1;
-		}
-		
-		glyph_codes = NULL;
-		glyphs = (struct bfa_glyph*)&file_buffer[sizeof(struct bfa_header)];
-		struct bfa_glyph *glyph = &glyphs[input_unicode];
-		print_glyph(glyph);
+		printf("Unicode value 0x%x out of range.\n", input_unicode);
+		return 1;
 	}
-	
-	END:
+
+	free_runtime_table(&table);
 	free(file_buffer);
 	
 	return 0;